@@ -1,39 +1,63 @@
 #include "ofMain.h"
 #include "ofxBvh.h"
+#include <atomic>
+#include <numeric>
 //labels
 vector<string>label_str = {"tPose", "hand", "foot", "all", "fun", "sad", "robot", "sexy", "junkie", "bouncie", "wavey", "swingy"};
 
-void exportPositions(ofxBvh& bvh, string filename, bool relative=false, float bpm = 90) {
+// labels frames of a take from its tempo: label 0 is the two bar count-in
+// (after offset seconds), then each label lasts eight bars, and everything
+// after the last label gets label_str.size()
+class TakeTiming {
+public:
+    int frames = 0;
+    int countInFrames = 0;
+    int segmentFrames = 1;
+    TakeTiming() {
+    }
+    TakeTiming(int frames, float frameTime, float bpm = 90, float offset = 0)
+    :frames(frames) {
+        double two_bars = 60. / bpm * 8 * 2;
+        double eight_bars = 60. / bpm * 8 * 8;
+        // round, so bars that land exactly on a frame aren't truncated one frame early
+        countInFrames = round((offset + two_bars) / frameTime);
+        segmentFrames = max(1, int(round(eight_bars / frameTime)));
+    }
+    int getLabelCount() const {
+        return label_str.size() + 1;
+    }
+    int getLabel(int frame) const {
+        if(frame < countInFrames) {
+            return 0;
+        }
+        return min(int(label_str.size()), (frame - countInFrames) / segmentFrames + 1);
+    }
+    // frames [begin, end) covered by label, clipped to the take
+    void getFrameRange(int label, int& begin, int& end) const {
+        if(label == 0) {
+            begin = 0;
+            end = countInFrames;
+        } else {
+            begin = countInFrames + (label - 1) * segmentFrames;
+            end = label < int(label_str.size()) ? begin + segmentFrames : frames;
+        }
+        begin = min(begin, frames);
+        end = min(end, frames);
+    }
+};
+
+void exportPositions(ofxBvh& bvh, string filename, bool relative=false, float bpm = 90, float offset = 0) {
     ofFile output;
     output.open(filename, ofFile::WriteOnly);
     int m = bvh.getNumFrames();
     
-    float fps = 120;
-    
-    float two_bars = 60. / bpm * 8 * 2;
-    float eight_bars  = 60. / bpm * 8 * 8;
-    int two_bars_in_frames = two_bars * fps;
-    int eight_bars_in_frames = eight_bars * fps;
+    TakeTiming timing(m, 1 / bvh.getFrameRate(), bpm, offset);
 
-    int label ;
     auto& joints = bvh.getJoints();
     for(int j = 0; j < m; j++) {
         int n = joints.size();
         
-        if(j < two_bars_in_frames)
-        {
-            label = 0;
-        }
-        else if(j < two_bars_in_frames + eight_bars_in_frames * 11  )
-        {
-            label = (j - two_bars_in_frames) / eight_bars_in_frames + 1;
-        }
-        else
-        {
-            label = 12;
-        }
-        
-        output << label << "\t";
+        output << timing.getLabel(j) << "\t";
         
         bvh.setFrame(j);
         bvh.update();
@@ -58,6 +82,503 @@ void exportPositions(ofxBvh& bvh, string filename, bool relative=false, float bp
     output.close();
 }
 
+// indexes the labelled segments of several takes, with aggregates computed
+// once per segment so queries never need to evaluate the bvh again
+class SegmentIndex {
+public:
+    struct Segment {
+        int take, label;
+        int begin, end;
+        vector<ofVec3f> mean, variance; // per joint
+        ofVec3f minimum, maximum; // bounds of all joints
+        float energy = 0; // squared joint speeds, summed over joints and averaged over frames
+    };
+    struct Take {
+        string name;
+        TakeTiming timing;
+        int firstSegment;
+    };
+    
+    vector<Take> takes;
+    vector<Segment> segments;
+    vector<vector<int>> segmentsByLabel;
+    
+    // returns the take index
+    int addTake(ofxBvh& bvh, string name, float bpm = 90, float offset = 0) {
+        int n = bvh.getNumFrames();
+        int m = bvh.getJoints().size();
+        float frameTime = 1 / bvh.getFrameRate();
+        Take take;
+        take.name = name;
+        take.timing = TakeTiming(n, frameTime, bpm, offset);
+        take.firstSegment = segments.size();
+        int takeIndex = takes.size();
+        takes.push_back(take);
+        
+        // evaluating the bvh is stateful, so collect positions serially
+        vector<ofVec3f> positions(size_t(n) * m);
+        for(int i = 0; i < n; i++) {
+            bvh.setFrame(i);
+            bvh.update();
+            for(int j = 0; j < m; j++) {
+                positions[size_t(i) * m + j] = bvh.getJoints()[j]->getPosition();
+            }
+        }
+        
+        int labels = take.timing.getLabelCount();
+        segmentsByLabel.resize(labels);
+        for(int label = 0; label < labels; label++) {
+            Segment segment;
+            segment.take = takeIndex;
+            segment.label = label;
+            take.timing.getFrameRange(label, segment.begin, segment.end);
+            // short takes don't reach every label, only index the ones with frames
+            if(segment.begin < segment.end) {
+                segmentsByLabel[label].push_back(segments.size());
+            }
+            segments.push_back(segment);
+        }
+        
+        // then aggregate all the segments in parallel
+        vector<std::thread> threads;
+        for(int label = 0; label < labels; label++) {
+            Segment& segment = segments[take.firstSegment + label];
+            threads.emplace_back([&segment, &positions, m, frameTime] {
+                aggregate(segment, positions, m, frameTime);
+            });
+        }
+        for(auto& thread : threads) {
+            thread.join();
+        }
+        return takeIndex;
+    }
+    int getLabel(int take, int frame) const {
+        return takes[take].timing.getLabel(frame);
+    }
+    void getFrameRange(int take, int label, int& begin, int& end) const {
+        takes[take].timing.getFrameRange(label, begin, end);
+    }
+    // labels past the end of a short take give an empty segment (begin == end)
+    // with no aggregates, check before using it
+    const Segment& getSegment(int take, int label) const {
+        return segments[takes[take].firstSegment + label];
+    }
+    // indices into segments for all non-empty segments with this label across
+    // all takes, these stay valid when more takes are added
+    vector<int> getSegments(int label) const {
+        if(label < 0 || label >= int(segmentsByLabel.size())) {
+            return {};
+        }
+        return segmentsByLabel[label];
+    }
+    vector<int> getSegments(string label) const {
+        auto found = std::find(label_str.begin(), label_str.end(), label);
+        if(found == label_str.end()) {
+            return {};
+        }
+        return getSegments(int(found - label_str.begin()));
+    }
+    
+private:
+    static void aggregate(Segment& segment, const vector<ofVec3f>& positions, int m, float frameTime) {
+        segment.mean.assign(m, ofVec3f());
+        segment.variance.assign(m, ofVec3f());
+        int frames = segment.end - segment.begin;
+        if(frames <= 0) {
+            return;
+        }
+        // accumulate in double, long segments lose too much precision in float
+        vector<double> sum(m * 3, 0), sumSquared(m * 3, 0);
+        const ofVec3f* x = &positions[size_t(segment.begin) * m];
+        segment.minimum = segment.maximum = x[0];
+        double speedSquared = 0;
+        for(int i = 0; i < frames; i++) {
+            const ofVec3f* cur = x + size_t(i) * m;
+            for(int j = 0; j < m; j++) {
+                for(int k = 0; k < 3; k++) {
+                    sum[j * 3 + k] += cur[j][k];
+                    sumSquared[j * 3 + k] += double(cur[j][k]) * cur[j][k];
+                    segment.minimum[k] = min(segment.minimum[k], cur[j][k]);
+                    segment.maximum[k] = max(segment.maximum[k], cur[j][k]);
+                }
+                if(i > 0) {
+                    speedSquared += cur[j].squareDistance(cur[j - m]);
+                }
+            }
+        }
+        for(int j = 0; j < m; j++) {
+            for(int k = 0; k < 3; k++) {
+                double mean = sum[j * 3 + k] / frames;
+                segment.mean[j][k] = mean;
+                segment.variance[j][k] = max(0., sumSquared[j * 3 + k] / frames - mean * mean);
+            }
+        }
+        if(frames > 1) {
+            segment.energy = speedSquared / ((frames - 1) * frameTime * frameTime);
+        }
+    }
+};
+
+template <class T>
+void readNpyData(ofFile& file, vector<float>& data) {
+    vector<T> raw(data.size());
+    file.read((char*) raw.data(), raw.size() * sizeof(T));
+    std::copy(raw.begin(), raw.end(), data.begin());
+}
+
+// minimal .npy support for little-endian, C-ordered float or int arrays
+// like the ones written by np.save() in "csv to npy.ipynb", loaded as float
+bool loadNpy(string filename, vector<float>& data, vector<int>& shape) {
+    ofFile file(filename, ofFile::ReadOnly, true);
+    if(!file.exists()) {
+        ofLogError("loadNpy") << "can't find " << filename;
+        return false;
+    }
+    char magic[6];
+    unsigned char version[2];
+    file.read(magic, 6);
+    file.read((char*) version, 2);
+    if(string(magic, 6) != "\x93NUMPY") {
+        ofLogError("loadNpy") << filename << " is not a .npy file";
+        return false;
+    }
+    uint32_t headerLength = 0;
+    if(version[0] == 1) {
+        uint16_t shortLength = 0;
+        file.read((char*) &shortLength, 2);
+        headerLength = shortLength;
+    } else {
+        file.read((char*) &headerLength, 4);
+    }
+    string header(headerLength, ' ');
+    file.read(&header[0], headerLength);
+    if(!file) {
+        ofLogError("loadNpy") << filename << " ends before the end of its header";
+        return false;
+    }
+
+    string descr;
+    for(string type : {"'<f4'", "'<f8'", "'<i4'", "'<i8'"}) {
+        if(header.find(type) != string::npos) {
+            descr = type;
+        }
+    }
+    if(descr == "" || header.find("'fortran_order': True") != string::npos) {
+        ofLogError("loadNpy") << "unsupported header in " << filename << ": " << header;
+        return false;
+    }
+    size_t key = header.find("'shape'");
+    size_t begin = key == string::npos ? key : header.find('(', key);
+    size_t end = begin == string::npos ? begin : header.find(')', begin);
+    if(end == string::npos) {
+        ofLogError("loadNpy") << "no shape in header of " << filename << ": " << header;
+        return false;
+    }
+    shape.clear();
+    for(auto& dimension : ofSplitString(header.substr(begin + 1, end - begin - 1), ",", true, true)) {
+        shape.push_back(ofToInt(dimension));
+        if(shape.back() < 0) {
+            ofLogError("loadNpy") << "bad shape in header of " << filename << ": " << header;
+            return false;
+        }
+    }
+
+    size_t count = 1;
+    for(int dimension : shape) {
+        count *= dimension;
+    }
+    data.resize(count);
+    if(descr == "'<f4'") {
+        file.read((char*) data.data(), count * sizeof(float));
+    } else if(descr == "'<f8'") {
+        readNpyData<double>(file, data);
+    } else if(descr == "'<i4'") {
+        readNpyData<int32_t>(file, data);
+    } else {
+        readNpyData<int64_t>(file, data);
+    }
+    return !file.fail();
+}
+
+// writes just the header of a float32 .npy so the data can be streamed in after it.
+// returns the offset where the data starts, or 0 if the file can't be written.
+size_t saveNpyHeader(string filename, const vector<int>& shape) {
+    string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (";
+    for(int dimension : shape) {
+        header += ofToString(dimension) + ",";
+    }
+    header += "), }";
+    // pad so the data starts on a 64 byte boundary
+    size_t prefixLength = 10 + header.size() + 1;
+    header.append((64 - prefixLength % 64) % 64, ' ');
+    header += "\n";
+    uint16_t headerLength = header.size();
+
+    ofFile output(filename, ofFile::WriteOnly, true);
+    output.write("\x93NUMPY\x01\x00", 8);
+    output.write((const char*) &headerLength, 2);
+    output.write(header.data(), header.size());
+    if(!output) {
+        ofLogError("saveNpyHeader") << "can't write " << filename;
+        return 0;
+    }
+    output.close();
+    return 10 + header.size();
+}
+
+// running sum and sum of squares over a sliding window of frames.
+// each frame is a contiguous row of channels, so add and remove vectorize.
+class RunningWindow {
+public:
+    vector<double> sum, sumSquared;
+    int count = 0;
+    RunningWindow(int channels)
+    :sum(channels, 0)
+    ,sumSquared(channels, 0) {
+    }
+    void add(const float* x) {
+        int n = sum.size();
+        for(int i = 0; i < n; i++) {
+            sum[i] += x[i];
+            sumSquared[i] += double(x[i]) * x[i];
+        }
+        count++;
+    }
+    void remove(const float* x) {
+        int n = sum.size();
+        for(int i = 0; i < n; i++) {
+            sum[i] -= x[i];
+            sumSquared[i] -= double(x[i]) * x[i];
+        }
+        count--;
+    }
+};
+
+vector<pair<int, int>> allJointPairs(int joints) {
+    vector<pair<int, int>> pairs;
+    for(int i = 0; i < joints; i++) {
+        for(int j = i + 1; j < joints; j++) {
+            pairs.emplace_back(i, j);
+        }
+    }
+    return pairs;
+}
+
+// q and -q are the same rotation, so flip each quat to the same sign as the one
+// before it within a take, otherwise the flip looks like a huge jump in motion.
+// assumes [frames x joints x 4] quats encoded as q / 2 + 0.5 like exportRotations()
+// in BVHGraph writes them, so -q is stored as 1 - v.
+void alignQuaternions(vector<float>& x, int joints, const vector<int>& takeFrames) {
+    int begin = 0;
+    for(int takeLength : takeFrames) {
+        for(int t = begin + 1; t < begin + takeLength; t++) {
+            float* previous = &x[size_t(t - 1) * joints * 4];
+            float* current = previous + joints * 4;
+            for(int j = 0; j < joints; j++) {
+                float* p = previous + j * 4;
+                float* q = current + j * 4;
+                float dot = 0;
+                for(int k = 0; k < 4; k++) {
+                    dot += (2 * p[k] - 1) * (2 * q[k] - 1);
+                }
+                if(dot < 0) {
+                    for(int k = 0; k < 4; k++) {
+                        q[k] = 1 - q[k];
+                    }
+                }
+            }
+        }
+        begin += takeLength;
+    }
+}
+
+// assumes the data is [frames x joints x dims], e.g. positions or quats
+// (after alignQuaternions), made of takes with takeFrames frames each joined
+// end to end (one take if empty).
+// streams [samples x features] to the .npy file output, sampled every skip frames
+// from the start of each take, where each row is velocity, acceleration, window
+// mean and window std dev for every channel, followed by the distance between each
+// joint pair. only pass pairs for positions, euler angles are also 3 dims but have
+// no meaningful distance.
+// the window covers frames within +/-window of the sample, and no feature
+// looks across a take boundary. expects skip >= 1, window >= 0 and takes of at
+// least one frame, exportMotionFeatures checks these before calling it.
+bool extractMotionFeatures(const vector<float>& x, int frames, int joints, int dims, string output,
+                           const vector<int>& takeFrames = {}, float frameTime = 1. / 120,
+                           int window = 15, int skip = 15, const vector<pair<int, int>>& pairs = {}) {
+    int channels = joints * dims;
+    int pairCount = dims == 3 ? pairs.size() : 0;
+    int featureCount = 4 * channels + pairCount;
+
+    vector<int> takeBegins = {0};
+    for(int takeLength : takeFrames.empty() ? vector<int>{frames} : takeFrames) {
+        takeBegins.push_back(takeBegins.back() + takeLength);
+    }
+    vector<int> sampleFrames, sampleTakes;
+    for(int take = 0; take + 1 < int(takeBegins.size()); take++) {
+        for(int t = takeBegins[take]; t < takeBegins[take + 1]; t += skip) {
+            sampleFrames.push_back(t);
+            sampleTakes.push_back(take);
+        }
+    }
+    int samples = sampleFrames.size();
+    size_t dataOffset = saveNpyHeader(output, {samples, featureCount});
+    if(dataOffset == 0) {
+        return false;
+    }
+
+    // each thread handles a contiguous chunk of samples, seeding its window
+    // at the first sample of each take and then sliding it frame by frame.
+    // rows are computed a block at a time and written at their own offset,
+    // so the whole feature matrix never needs to be in memory.
+    const int blockSamples = 64;
+    std::atomic<bool> written(true);
+    auto extractChunk = [&](int beginSample, int endSample) {
+        ofFile file(output, ofFile::ReadWrite, true);
+        file.seekp(dataOffset + size_t(beginSample) * featureCount * sizeof(float));
+        vector<float> block(size_t(blockSamples) * featureCount);
+        RunningWindow running(channels);
+        int take = -1, t = 0;
+        for(int sample = beginSample; sample < endSample; sample++) {
+            int target = sampleFrames[sample];
+            int begin = takeBegins[sampleTakes[sample]], end = takeBegins[sampleTakes[sample] + 1];
+            if(sampleTakes[sample] != take) {
+                take = sampleTakes[sample];
+                running = RunningWindow(channels);
+                t = target;
+                for(int i = max(begin, t - window); i <= min(end - 1, t + window); i++) {
+                    running.add(&x[size_t(i) * channels]);
+                }
+            }
+            for(; t < target; t++) {
+                if(t - window >= begin) {
+                    running.remove(&x[size_t(t - window) * channels]);
+                }
+                if(t + window + 1 < end) {
+                    running.add(&x[size_t(t + window + 1) * channels]);
+                }
+            }
+
+            int row = (sample - beginSample) % blockSamples;
+            int previous = max(begin, t - 1), next = min(end - 1, t + 1);
+            const float* xp = &x[size_t(previous) * channels];
+            const float* xc = &x[size_t(t) * channels];
+            const float* xn = &x[size_t(next) * channels];
+            float* velocity = &block[size_t(row) * featureCount];
+            float* acceleration = velocity + channels;
+            float* mean = acceleration + channels;
+            float* deviation = mean + channels;
+            float* distance = deviation + channels;
+
+            float velocityScale = next > previous ? 1 / ((next - previous) * frameTime) : 0;
+            float accelerationScale = (previous < t && t < next) ? 1 / (frameTime * frameTime) : 0;
+            double countScale = 1. / running.count;
+            // separate loops so each one vectorizes: mixing the double window sums
+            // into the float differences blocks it, and sqrtf needs -fno-math-errno
+            for(int i = 0; i < channels; i++) {
+                velocity[i] = (xn[i] - xp[i]) * velocityScale;
+                acceleration[i] = (xn[i] - 2 * xc[i] + xp[i]) * accelerationScale;
+            }
+            const double* sum = running.sum.data();
+            const double* sumSquared = running.sumSquared.data();
+            for(int i = 0; i < channels; i++) {
+                double m = sum[i] * countScale;
+                mean[i] = m;
+                deviation[i] = sumSquared[i] * countScale - m * m;
+            }
+            for(int i = 0; i < channels; i++) {
+                deviation[i] = sqrtf(max(0.f, deviation[i]));
+            }
+            for(int i = 0; i < pairCount; i++) {
+                const float* a = xc + pairs[i].first * 3;
+                const float* b = xc + pairs[i].second * 3;
+                float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+                distance[i] = sqrt(dx * dx + dy * dy + dz * dz);
+            }
+
+            if(row + 1 == blockSamples || sample + 1 == endSample) {
+                file.write((const char*) block.data(), size_t(row + 1) * featureCount * sizeof(float));
+            }
+        }
+        if(!file) {
+            written = false;
+        }
+        file.close();
+    };
+
+    int threadCount = max(1, min(samples, int(std::thread::hardware_concurrency())));
+    int chunkSize = (samples + threadCount - 1) / threadCount;
+    vector<std::thread> threads;
+    for(int beginSample = 0; beginSample < samples; beginSample += chunkSize) {
+        threads.emplace_back(extractChunk, beginSample, min(samples, beginSample + chunkSize));
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    if(!written) {
+        ofLogError("extractMotionFeatures") << "couldn't write all the features to " << output;
+    }
+    return written;
+}
+
+// skip defaults to 15 to match skipFrames in ofApp::draw(), so the notebook
+// doesn't subsample these features again
+// positions adds joint-pair distances, leave it off for euler angles and quats.
+// quats (4 dims) are sign aligned with alignQuaternions() first.
+// takeFramesInput is an optional .npy with the frame count of each take in input
+void exportMotionFeatures(string input, string output, bool positions, string takeFramesInput = "",
+                          float frameTime = 1. / 120, int window = 15, int skip = 15) {
+    vector<float> x;
+    vector<int> shape;
+    if(!loadNpy(input, x, shape)) {
+        return;
+    }
+    vector<int> takeFrames;
+    if(takeFramesInput != "") {
+        vector<float> takeFramesData;
+        vector<int> takeFramesShape;
+        if(!loadNpy(takeFramesInput, takeFramesData, takeFramesShape)) {
+            return;
+        }
+        takeFrames.assign(takeFramesData.begin(), takeFramesData.end());
+    }
+    if(shape.size() != 3) {
+        ofLogError("exportMotionFeatures") << input << " should be [frames x joints x dims]";
+        return;
+    }
+    int frames = shape[0], joints = shape[1], dims = shape[2];
+    if(frames == 0 || joints == 0 || dims == 0) {
+        ofLogError("exportMotionFeatures") << input << " is empty";
+        return;
+    }
+    if(skip < 1 || window < 0) {
+        ofLogError("exportMotionFeatures") << "skip should be at least 1 and window at least 0, not " << skip << " and " << window;
+        return;
+    }
+    for(int takeLength : takeFrames) {
+        if(takeLength <= 0) {
+            ofLogError("exportMotionFeatures") << takeFramesInput << " has a take with " << takeLength << " frames";
+            return;
+        }
+    }
+    if(!takeFrames.empty() && std::accumulate(takeFrames.begin(), takeFrames.end(), 0) != frames) {
+        ofLogError("exportMotionFeatures") << takeFramesInput << " doesn't add up to the " << frames << " frames in " << input;
+        return;
+    }
+    if(positions && dims != 3) {
+        ofLogError("exportMotionFeatures") << input << " should be [frames x joints x 3] for positions";
+        return;
+    }
+    vector<pair<int, int>> pairs;
+    if(positions) {
+        pairs = allJointPairs(joints);
+    }
+    if(dims == 4) {
+        alignQuaternions(x, joints, takeFrames.empty() ? vector<int>{frames} : takeFrames);
+    }
+    extractMotionFeatures(x, frames, joints, dims, output, takeFrames, frameTime, window, skip, pairs);
+}
+
 float smoothStep(float x) {
     return 3*(x*x) - 2*(x*x*x);
 }
@@ -134,6 +655,14 @@ public:
 //        exportPositions(bvh, "erisa004-absolute-export.tsv", false, 90);
 //        exportPositions(bvh, "erisa003-relative-export.tsv", true);
 //        exportQuaternions(bvh, "erisa003-quaternions.tsv");
+//        // the csv exports are 120fps, see samplerate in "csv to npy.ipynb"
+//        exportMotionFeatures("global_positions.npy", "global_positions-features.npy", true, "global_positions-take_frames.npy", 1. / 120);
+//        SegmentIndex segments;
+//        segments.addTake(bvh, "erisa003", 90);
+//        for(int i : segments.getSegments("robot")) {
+//            auto& segment = segments.segments[i];
+//            ofLog() << segments.takes[segment.take].name << " " << segment.begin << "-" << segment.end << " energy " << segment.energy;
+//        }
         
 //        bvh.play();
         bvh.setLoop(true);